@@ -0,0 +1,115 @@
+/******************************************
+ * nadaBench.cpp
+ * Compare the n-gram count backends: load
+ * time, memory and look-up speed
+ ******************************************/
+#include <iostream>   // For reading/writing STDIN
+#include <sstream>    // For parsing the input
+#include <fstream>    // For reading /proc
+#include <sys/time.h> // For wall-clock timing (loading is multi-threaded)
+#include <unistd.h>   // For the page size, and fork()
+#include <sys/wait.h> // For waiting on each backend's process
+#include "nadaCommon.h"
+
+const std::string USAGE = "USAGE: cat tokenizedFile | ./nadaBench compressedNgramCnts textNgramCnts [passes]";
+
+// Seconds since some fixed point:
+double wallClock() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec + now.tv_usec/1e6;
+}
+// Resident set size of this process, in bytes (0 if we can't tell):
+size_t residentBytes() {
+  std::ifstream statm("/proc/self/statm");
+  size_t pages = 0, resident = 0;
+  statm >> pages >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+// The patterns of each sentence, and where its 'it's are:
+struct BenchSentence {
+  StrVec patts;
+  Indices itPositions;
+};
+// Load one backend, then run every 'it' through its n-gram look-ups:
+void benchBackend(const std::string &name, NgramMapBase &cnts, char *filename,
+				  const std::vector<BenchSentence> &sentences, int passes) {
+  size_t rssBefore = residentBytes();
+  double startTime = wallClock();
+  cnts.initialize(filename);
+  double loadTime = wallClock() - startTime;
+  size_t rssAfter = residentBytes();
+  size_t rssGrowth = (rssAfter > rssBefore) ? rssAfter - rssBefore : 0;
+  std::cerr << name << " memory:" << std::endl;
+  size_t modelBytes = cnts.reportMemory();
+  // Sum up the features, so we can tell the backends agree:
+  double checksum = 0;
+  size_t instances = 0;
+  startTime = wallClock();
+  for (int pass=0; pass<passes; pass++) {
+	for (size_t s=0; s<sentences.size(); s++) {
+	  for (size_t i=0; i<sentences[s].itPositions.size(); i++) {
+		RealFeats cntFeats;
+		buildCntFeatureVector(sentences[s].itPositions[i], sentences[s].patts, cnts, cntFeats);
+		for (RealFeats::const_iterator itr=cntFeats.begin(); itr != cntFeats.end(); itr++)
+		  checksum += itr->second;
+		instances++;
+	  }
+	}
+  }
+  double lookupTime = wallClock() - startTime;
+  std::cout.precision(3);
+  std::cout << name << '\t' << std::fixed << loadTime << '\t' << modelBytes << '\t' << rssGrowth
+			<< '\t' << (instances ? 1e6*lookupTime/instances : 0) << '\t' << checksum << std::endl;
+}
+////////////////////////////////////////////////
+// Run program
+////////////////////////////////////////////////
+int main(int nargin, char** argv) {
+  if (nargin != 3 && nargin != 4) {
+    std::cerr << USAGE << std::endl;
+	exit(-1);
+  }
+  int passes = (nargin == 4) ? atoi(argv[3]) : 100;
+  // Read and patternize the input once, up front, as nadaIt does:
+  std::vector<BenchSentence> sentences;
+  std::string input;
+  while (getline(std::cin, input)) {
+    BenchSentence sentence;
+    std::stringstream line(input);
+    std::string word;
+    while (getline(line, word, ' ')) {
+      if (word == "it" || word == "It" || word == "IT" || word == "iT") sentence.itPositions.push_back(sentence.patts.size());
+      patternizeToken(word);
+      sentence.patts.push_back(word);
+    }
+    if (!sentence.itPositions.empty())
+	  sentences.push_back(sentence);
+  }
+  // Each backend gets the same look-ups; the checksums should match
+  // if the two files hold the same counts:
+  std::cout << "backend\tload(s)\tmodel(bytes)\tRSS growth(bytes)\tus/instance\tchecksum" << std::endl;
+  // Each backend runs in its own process, so neither one's RSS growth
+  // is hidden by reusing heap the other has freed:
+  for (int backend=0; backend<2; backend++) {
+	std::cout.flush();
+	pid_t child = fork();
+	if (child < 0) {
+	  std::cerr << "Error! Can not start a process for the benchmark" << std::endl;
+	  exit(-1);
+	}
+	if (child == 0) {
+	  if (backend == 0) {
+		NgramCompressedCntMap compressedCnts;
+		benchBackend("compressed", compressedCnts, argv[1], sentences, passes);
+	  } else {
+		NgramCntMap textCnts;
+		benchBackend("text", textCnts, argv[2], sentences, passes);
+	  }
+	  std::cout.flush();
+	  _exit(0);
+	}
+	waitpid(child, NULL, 0);
+  }
+  return 1;
+}
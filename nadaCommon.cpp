@@ -8,6 +8,16 @@
 #include <iostream> // For reading/writing STDIN
 #include <fstream>  // For reading files
 #include <sstream>  // For converting a lookup string to a set of tokens
+#include <algorithm> // For sorting/searching the compact n-gram table
+#include <unistd.h>   // For paging out and mapping in the n-gram tables:
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>  // For loading the text n-gram counts in parallel
+#ifdef __linux__
+#include <sys/vfs.h>     // For spotting tmpfs
+#include <linux/magic.h>
+#endif
 // Anything capitalized and longer than this will be a named-entity
 const size_t NAMED_ENTITY_CUTOFF = 4;
 // And all tokens will be truncated to this length:
@@ -268,41 +278,56 @@ void buildLexicalFeatureVector(size_t itPos, const StrVec &words, StrVec &binFea
   // And, finally, incorporate our bias:
   binFeats.push_back("bias");
 }
+// Add the features for one N-gram's it/they counts, as found at this offset:
+void addNgramCntFeatures(int size, int offset, uint32_t itCount, uint32_t theyCount, RealFeats &rfeats, StrCountMap &totalCounts) {
+  if (itCount != 0) {
+	std::string featStr = fastInt2Str(size) + "," + fastInt2Str(offset) + "+IT"; rfeats.push_back( StrFloatPair(featStr,log(itCount+SMOOTHING)) ); //$size,$offset+IT:$it
+	// Collect the aggregate counts here:
+	featStr = fastInt2Str(size) + "+IT";  totalCounts[featStr] += itCount;
+  } else {
+	std::string featStr = fastInt2Str(size) + "," + fastInt2Str(offset) + "+IT-UNDEF"; rfeats.push_back( StrFloatPair(featStr,1.0) ); //$size,$offset+IT-UNDEF
+  }
+  if (theyCount != 0) {
+	std::string featStr = fastInt2Str(size) + "," + fastInt2Str(offset) + "+THEY"; rfeats.push_back( StrFloatPair(featStr,log(theyCount+SMOOTHING)) ); //$size,$offset+THEY:$they
+	featStr = fastInt2Str(size) + "+THEY";  totalCounts[featStr] += theyCount;
+  } else {
+	std::string featStr = fastInt2Str(size) + "," + fastInt2Str(offset) + "+THEY-UNDEF"; rfeats.push_back( StrFloatPair(featStr,1.0) ); //$size,$offset+THEY-UNDEF
+  }
+}
+// Add the aggregate statistics over all offsets, in log form:
+void addTotalCntFeatures(const StrCountMap &totalCounts, RealFeats &rfeats) {
+  for (StrCountMap::const_iterator itr = totalCounts.begin(); itr != totalCounts.end(); ++itr) {
+	rfeats.push_back( StrFloatPair(itr->first,log(itr->second+SMOOTHING)) );
+  }
+}
 // Build the n-gram count features (real-valued)
 void buildCntFeatureVector(size_t itPos, const StrVec &patts, const NgramMapBase &cnts, RealFeats &rfeats) {
   // A) Extract the n-grams of each size -- here, only do one size:
   int size = CNTNGRAMSIZE;
   // Also get some aggregate counts over all offsets:
-  StrIntMap totalCounts;
+  StrCountMap totalCounts;
   for (int start = (int)(itPos)-(size-1); start<=(int)itPos; start++) {
     std::string ngram = checkAndPrintNGram(start, size, itPos, patts, ' ');
     int offset = (itPos-start);
     if (ngram != "") {
       // Get the counts for this N-gram:
-	  int itCount = 0;
-	  int theyCount = 0;
+	  uint32_t itCount = 0;
+	  uint32_t theyCount = 0;
       cnts.find(ngram,itCount,theyCount);
-	  if (itCount != 0) {
-		std::string featStr = fastInt2Str(size) + "," + fastInt2Str(offset) + "+IT"; rfeats.push_back( StrFloatPair(featStr,log(itCount+SMOOTHING)) ); //$size,$offset+IT:$it
-		// Collect the aggregate counts here:
-		featStr = fastInt2Str(size) + "+IT";  totalCounts[featStr] += itCount;
-	  } else {
-		std::string featStr = fastInt2Str(size) + "," + fastInt2Str(offset) + "+IT-UNDEF"; rfeats.push_back( StrFloatPair(featStr,1.0) ); //$size,$offset+IT-UNDEF
-	  }
-	  if (theyCount != 0) {
-		std::string featStr = fastInt2Str(size) + "," + fastInt2Str(offset) + "+THEY"; rfeats.push_back( StrFloatPair(featStr,log(theyCount+SMOOTHING)) ); //$size,$offset+THEY:$they
-		featStr = fastInt2Str(size) + "+THEY";  totalCounts[featStr] += theyCount;
-	  } else {
-		std::string featStr = fastInt2Str(size) + "," + fastInt2Str(offset) + "+THEY-UNDEF"; rfeats.push_back( StrFloatPair(featStr,1.0) ); //$size,$offset+THEY-UNDEF
-	  }
+	  addNgramCntFeatures(size, offset, itCount, theyCount, rfeats, totalCounts);
     } else {
       std::string featStr = fastInt2Str(size) + "," + fastInt2Str(offset) + "+NGM=UNDEF"; rfeats.push_back( StrFloatPair(featStr,1.0) ); //      $size,$offset+NGM=UNDEF
     }
   }
   // Now add those aggregate statistics, in log form:
-  for (StrIntMap::const_iterator itr = totalCounts.begin(); itr != totalCounts.end(); ++itr) {
-	rfeats.push_back( StrFloatPair(itr->first,log(itr->second+SMOOTHING)) );
-  }
+  addTotalCntFeatures(totalCounts, rfeats);
+}
+// Turn a score into a probability. The decision mode maps its score
+// bounds through here too, so both round the same way:
+float scoreToProbability(float score) {
+  float exponentiated = exp(score);
+  float probability = exponentiated / (1.0+exponentiated);
+  return probability;
 }
 // Get the 0/1 prediction for this example
 float getPredictions(const FeatureWeightMap &weights, const StrVec &binFeats, const RealFeats &realFeats) {
@@ -326,9 +351,153 @@ float getPredictions(const FeatureWeightMap &weights, const StrVec &binFeats, co
 	}
   }
   // Now turn this into a probability:
-  float exponentiated = exp(score);
-  float probability = exponentiated / (1.0+exponentiated);
-  return probability;
+  return scoreToProbability(score);
+}
+////////////////////////////////////////////////////////////
+// The thresholded decision mode:
+////////////////////////////////////////////////////////////
+// Widen the score bounds by this much before deciding early, to cover
+// the float rounding in getPredictions' sum. The bounds then go through
+// the same float exp/divide, so near-1 thresholds round the same way too:
+const double DECISION_SLACK = 1e-3;
+// The weight for this feature, or 0 if it has none:
+float weightOf(const FeatureWeightMap &weights, const std::string &feat) {
+  FeatureWeightMap::const_iterator finder = weights.find(feat);
+  return (finder != weights.end()) ? finder->second : 0;
+}
+// Precompute the per-template score bounds from the weights and n-gram data:
+void initializeDecisionBounds(const FeatureWeightMap &weights, const NgramMapBase &cnts, DecisionBounds &bounds) {
+  int size = CNTNGRAMSIZE;
+  for (int offset=0; offset<size; offset++) {
+	std::string prefix = fastInt2Str(size) + "," + fastInt2Str(offset);
+	bounds.ngmUndef.push_back(weightOf(weights, prefix + "+NGM=UNDEF"));
+	bounds.it.push_back(weightOf(weights, prefix + "+IT"));
+	bounds.itUndef.push_back(weightOf(weights, prefix + "+IT-UNDEF"));
+	bounds.they.push_back(weightOf(weights, prefix + "+THEY"));
+	bounds.theyUndef.push_back(weightOf(weights, prefix + "+THEY-UNDEF"));
+  }
+  bounds.totalIt = weightOf(weights, fastInt2Str(size) + "+IT");
+  bounds.totalThey = weightOf(weights, fastInt2Str(size) + "+THEY");
+  bounds.maxCount = cnts.maxCount();
+}
+// Widen [lo,hi] to take in this value:
+inline void widenRange(double v, double &lo, double &hi) {
+  if (v < lo) lo = v;
+  if (v > hi) hi = v;
+}
+// The range of what one count template (found:wt*log(cnt), else undefWt) can add:
+void countRange(float wt, float undefWt, uint32_t maxCount, double &lo, double &hi) {
+  lo = hi = undefWt;
+  if (maxCount > 0) {
+	widenRange(wt*log(1+SMOOTHING), lo, hi);
+	widenRange(wt*log(maxCount+SMOOTHING), lo, hi);
+  }
+}
+// The range of what an aggregate template can add, given the total
+// so far and how many look-ups could still add to it:
+void totalRange(float wt, uint64_t known, size_t remaining, uint32_t maxCount, double &lo, double &hi) {
+  double most = known + (double)remaining*maxCount;
+  if (known != 0) {
+	lo = hi = wt*log(known+SMOOTHING);
+  } else {
+	lo = hi = 0; // The aggregate feature is absent if nothing is found
+	if (most == 0) return;
+	widenRange(wt*log(1+SMOOTHING), lo, hi);
+  }
+  widenRange(wt*log(most+SMOOTHING), lo, hi);
+}
+// Get the thresholded 0/1 decision for this example. The bias and
+// lexical weights come straight from memory; then we probe the
+// n-grams whose outcome could move the score the most, and stop as
+// soon as the remaining ones can't carry the score across the threshold.
+bool getDecision(const FeatureWeightMap &weights, const DecisionBounds &bounds, float threshold,
+				 size_t itPos, const StrVec &binFeats, const StrVec &patts, const NgramMapBase &cnts,
+				 DecisionStats &stats) {
+  double score = 0;
+  for (StrVec::const_iterator itr=binFeats.begin(); itr != binFeats.end(); itr++) {
+	FeatureWeightMap::const_iterator finder = weights.find(*itr);
+	if (finder != weights.end())
+	  score += finder->second;
+  }
+  // N-grams that fall off the sentence need no look-up; the rest are
+  // pending, each with the range of what its look-up could add:
+  int size = CNTNGRAMSIZE;
+  StrVec ngrams(size);
+  std::vector<int> pending;
+  std::vector<double> lo(size), hi(size);
+  for (int start = (int)(itPos)-(size-1); start<=(int)itPos; start++) {
+	int offset = (itPos-start);
+	ngrams[offset] = checkAndPrintNGram(start, size, itPos, patts, ' ');
+	if (ngrams[offset] != "") {
+	  double itLo, itHi, theyLo, theyHi;
+	  countRange(bounds.it[offset], bounds.itUndef[offset], bounds.maxCount, itLo, itHi);
+	  countRange(bounds.they[offset], bounds.theyUndef[offset], bounds.maxCount, theyLo, theyHi);
+	  lo[offset] = itLo + theyLo;
+	  hi[offset] = itHi + theyHi;
+	  pending.push_back(offset);
+	} else {
+	  score += bounds.ngmUndef[offset];
+	}
+  }
+  std::vector<uint32_t> itCounts(size, 0), theyCounts(size, 0);
+  uint64_t itTotal = 0, theyTotal = 0;
+  while (true) {
+	// Bound the final score:
+	double low = score, high = score;
+	size_t widest = 0;
+	for (size_t i=0; i<pending.size(); i++) {
+	  low += lo[pending[i]];
+	  high += hi[pending[i]];
+	  if (hi[pending[i]]-lo[pending[i]] > hi[pending[widest]]-lo[pending[widest]])
+		widest = i;
+	}
+	double aggLo, aggHi;
+	totalRange(bounds.totalIt, itTotal, pending.size(), bounds.maxCount, aggLo, aggHi);
+	low += aggLo; high += aggHi;
+	totalRange(bounds.totalThey, theyTotal, pending.size(), bounds.maxCount, aggLo, aggHi);
+	low += aggLo; high += aggHi;
+	if (scoreToProbability(low - DECISION_SLACK) >= threshold) {
+	  stats.skipped += pending.size();
+	  return true;
+	}
+	if (scoreToProbability(high + DECISION_SLACK) < threshold) {
+	  stats.skipped += pending.size();
+	  return false;
+	}
+	if (pending.empty())
+	  break;
+	// Still undecided: look up the n-gram with the most impact:
+	int offset = pending[widest];
+	pending.erase(pending.begin()+widest);
+	cnts.find(ngrams[offset], itCounts[offset], theyCounts[offset]);
+	stats.lookups++;
+	if (itCounts[offset] != 0) {
+	  score += bounds.it[offset]*log(itCounts[offset]+SMOOTHING);
+	  itTotal += itCounts[offset];
+	} else {
+	  score += bounds.itUndef[offset];
+	}
+	if (theyCounts[offset] != 0) {
+	  score += bounds.they[offset]*log(theyCounts[offset]+SMOOTHING);
+	  theyTotal += theyCounts[offset];
+	} else {
+	  score += bounds.theyUndef[offset];
+	}
+  }
+  // Too close to call on the bounds: score it exactly as the full
+  // prediction does, from the counts we already have:
+  RealFeats realFeats;
+  StrCountMap totalCounts;
+  for (int start = (int)(itPos)-(size-1); start<=(int)itPos; start++) {
+	int offset = (itPos-start);
+	if (ngrams[offset] != "") {
+	  addNgramCntFeatures(size, offset, itCounts[offset], theyCounts[offset], realFeats, totalCounts);
+	} else {
+	  std::string featStr = fastInt2Str(size) + "," + fastInt2Str(offset) + "+NGM=UNDEF"; realFeats.push_back( StrFloatPair(featStr,1.0) );
+	}
+  }
+  addTotalCntFeatures(totalCounts, realFeats);
+  return getPredictions(weights, binFeats, realFeats) >= threshold;
 }
 // Load the weight vector from file:
 void initializeFeatureWeights(char *filename, FeatureWeightMap &weights) {
@@ -348,8 +517,269 @@ void initializeFeatureWeights(char *filename, FeatureWeightMap &weights) {
   file.close();  // close the file
   std::cerr << "> done" << std::endl;
 }
+////////////////////////////////////////////////////////////
+// Memory accounting:
+////////////////////////////////////////////////////////////
+// One line of the memory report:
+void reportBytes(bool report, const std::string &name, size_t entries, size_t bytes) {
+  if (report)
+	std::cerr << "  " << name << ": " << entries << " entries, " << bytes << " bytes" << std::endl;
+}
+// Count (and maybe print) the bytes held by the weights:
+size_t weightMemory(const FeatureWeightMap &weights, bool report) {
+  size_t bytes = hashMapBytes(weights);
+  for (FeatureWeightMap::const_iterator itr = weights.begin(); itr != weights.end(); ++itr)
+	bytes += stringHeapBytes(itr->first);
+  reportBytes(report, "weights", weights.size(), bytes);
+  return bytes;
+}
+/////////////////////////////////////////////////////////////////////////////////
+NgramCompressedCntMap::~NgramCompressedCntMap() {
+  if (paged != NULL)
+	munmap(paged, pagedBytes);
+}
+// Get the value rank for the packed tokens, from whichever representation:
+bool NgramCompressedCntMap::findValueRank(uint64_t token123, uint16_t &valueRank) const {
+  if (!compacted) {
+	TokenValueMap::const_iterator finder = tokenValMap.find(token123);
+	if (finder == tokenValMap.end())
+	  return false;
+	valueRank = finder->second; // The map just gives us the rank
+	return true;
+  }
+  const uint64_t *begin = ngrams, *end = ngrams+numNgrams;
+  if (paged != NULL) {
+	// Only the last page starting at or before these tokens can hold them:
+	std::vector<uint64_t>::const_iterator page =
+	  std::upper_bound(pageIndex.begin(), pageIndex.end(), (token123 << 16) | 0xFFFF);
+	if (page == pageIndex.begin())
+	  return false;
+	begin = ngrams + (page - pageIndex.begin() - 1)*entriesPerPage;
+	end = std::min(begin + entriesPerPage, end);
+  }
+  // The value rank sits in the low 16 bits, so search for the smallest
+  // entry with these tokens:
+  const uint64_t *finder = std::lower_bound(begin, end, token123 << 16);
+  if (finder == end || (*finder >> 16) != token123)
+	return false;
+  valueRank = (uint16_t)(*finder & 0xFFFF);
+  return true;
+}
+// How many bytes of this mapping are in memory right now:
+size_t mappedResidentBytes(void *addr, size_t bytes) {
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  std::vector<unsigned char> inCore((bytes + pageSize - 1) / pageSize);
+  if (inCore.empty() || mincore(addr, bytes, &inCore[0]) != 0)
+	return 0;
+  size_t pages = 0;
+  for (size_t i=0; i<inCore.size(); i++)
+	pages += inCore[i] & 1;
+  return std::min(pages*pageSize, bytes);
+}
+// Count (and maybe print) the bytes held by each of our structures;
+// returns the total resident:
+size_t NgramCompressedCntMap::memoryUsage(bool report) const {
+  size_t tokenBytes = hashMapBytes(token2rank);
+  for (String2Uint16::const_iterator itr = token2rank.begin(); itr != token2rank.end(); ++itr)
+	tokenBytes += stringHeapBytes(itr->first);
+  reportBytes(report, "token2rank", token2rank.size(), tokenBytes);
+  size_t valueBytes = vectorBytes(rank2values);
+  reportBytes(report, "rank2values", rank2values.size(), valueBytes);
+  size_t ngramBytes;
+  if (!compacted) {
+	ngramBytes = hashMapBytes(tokenValMap);
+	reportBytes(report, "tokenValMap", tokenValMap.size(), ngramBytes);
+  } else if (paged == NULL) {
+	ngramBytes = vectorBytes(sortedNgrams);
+	reportBytes(report, "tokenValMap (sorted)", numNgrams, ngramBytes);
+  } else {
+	// The mapped pages are clean, so the kernel can drop whichever go
+	// cold; only the page index is ours to hold:
+	ngramBytes = vectorBytes(pageIndex);
+	reportBytes(report, "tokenValMap (paged out: page index)", numNgrams, ngramBytes);
+	if (report)
+	  std::cerr << "    (plus " << pagedBytes << " bytes mapped from a temporary file, "
+				<< mappedResidentBytes(paged, pagedBytes) << " of them in memory now)" << std::endl;
+  }
+  return tokenBytes + valueBytes + ngramBytes;
+}
+// Read the next N-gram of Part 3, and its value rank; false at the end:
+bool readNgramRecord(std::ifstream &file, uint16_t &token1, uint16_t &token2, uint16_t &token3, uint16_t &values) {
+  uint16_t dummy;
+  if (!file.read((char *)&dummy, 2)) return false;
+  if (dummy == NEWFIRSTFLAG) { // You should re-read everything: tokens 1, 2, and 3
+	file.read((char *)&token1, 2);
+	file.read((char *)&token2, 2);
+	file.read((char *)&token3, 2);
+  } else if (dummy == NEWSECONDFLAG) { // You should read from token-2 onwards
+	file.read((char *)&token2, 2);
+	file.read((char *)&token3, 2);
+  } else { // You just read the token-3 (most frequent case)
+	token3 = dummy;
+  }
+  file.read((char *)&values, 2); // The value is always read last
+  return (bool)file;
+}
+// Pack the tokens into one value:
+inline uint64_t packTokens(uint16_t token1, uint16_t token2, uint16_t token3) {
+  return (uint64_t)(token3) + ((uint64_t)(token2) << 16) + ((uint64_t)(token1) << 32);
+}
+// Load Part 3 into the hash table (the fastest look-ups). If an N-gram
+// is repeated, its last record wins, in this and the other two forms:
+void NgramCompressedCntMap::loadHashed(std::ifstream &file, size_t numRecords) {
+  tokenValMap.rehash(numRecords);
+  uint16_t token1=0, token2=0, token3=0, values=0; // For reading them off
+  while (readNgramRecord(file, token1, token2, token3, values))
+	tokenValMap[packTokens(token1, token2, token3)] = values; // Store the tokens->value mapping
+}
+// Load Part 3 straight into the sorted array. The file is written in
+// token order, so we only sort if it turns out not to be:
+void NgramCompressedCntMap::loadSorted(std::ifstream &file, size_t numRecords) {
+  std::streampos part3Start = file.tellg();
+  sortedNgrams.reserve(numRecords);
+  bool inOrder = true;
+  uint16_t token1=0, token2=0, token3=0, values=0;
+  while (readNgramRecord(file, token1, token2, token3, values)) {
+	uint64_t entry = (packTokens(token1, token2, token3) << 16) | values;
+	if (!sortedNgrams.empty() && (entry >> 16) == (sortedNgrams.back() >> 16)) {
+	  sortedNgrams.back() = entry; // A repeat: the last record wins
+	  continue;
+	}
+	if (!sortedNgrams.empty() && (entry >> 16) < (sortedNgrams.back() >> 16))
+	  inOrder = false;
+	sortedNgrams.push_back(entry);
+  }
+  if (!inOrder) {
+	std::cerr << "(N-grams out of order: sorting) ";
+	std::sort(sortedNgrams.begin(), sortedNgrams.end());
+	std::vector<uint64_t>::iterator last = sortedNgrams.begin();
+	for (std::vector<uint64_t>::iterator itr = sortedNgrams.begin(); itr != sortedNgrams.end(); ++itr)
+	  if (last == sortedNgrams.begin() || (*itr >> 16) != (*(last-1) >> 16))
+		*last++ = *itr;
+	bool repeats = (last != sortedNgrams.end());
+	sortedNgrams.erase(last, sortedNgrams.end());
+	// The sort lost the file order of repeats, so read Part 3 again and
+	// let each record overwrite the rank; the last one is left standing
+	// (this needs no memory beyond the array itself):
+	if (repeats) {
+	  file.clear();
+	  file.seekg(part3Start);
+	  token1 = token2 = token3 = 0;
+	  while (readNgramRecord(file, token1, token2, token3, values)) {
+		uint64_t token123 = packTokens(token1, token2, token3);
+		std::vector<uint64_t>::iterator finder =
+		  std::lower_bound(sortedNgrams.begin(), sortedNgrams.end(), token123 << 16);
+		*finder = (token123 << 16) | values;
+	  }
+	}
+  }
+  compacted = true;
+  numNgrams = sortedNgrams.size();
+  ngrams = sortedNgrams.empty() ? NULL : &sortedNgrams[0];
+}
+// Write all of buf to the file, however many write() calls that takes:
+bool writeAll(int fd, const void *buf, size_t bytes) {
+  const char *pos = (const char *)buf;
+  while (bytes > 0) {
+	ssize_t written = write(fd, pos, bytes);
+	if (written <= 0) return false;
+	pos += written; bytes -= written;
+  }
+  return true;
+}
+// Is this file on a filesystem that lives in RAM anyway?
+bool inMemoryFileSystem(int fd) {
+#ifdef __linux__
+  struct statfs fsStat;
+  if (fstatfs(fd, &fsStat) == 0)
+	return fsStat.f_type == TMPFS_MAGIC || fsStat.f_type == RAMFS_MAGIC;
+#endif
+  return false;
+}
+// Entries we buffer while writing the n-grams out:
+const size_t PAGEOUTBUFFER = 8192;
+// Write count entries out to the paged-out file, adding the first
+// entry of each page to the page index as it goes by:
+bool writeNgrams(int fd, const uint64_t *entries, size_t count, size_t &written,
+				 size_t entriesPerPage, std::vector<uint64_t> &pageIndex) {
+  for (size_t i=0; i<count; i++)
+	if ((written + i) % entriesPerPage == 0)
+	  pageIndex.push_back(entries[i]);
+  written += count;
+  return writeAll(fd, entries, count*sizeof(uint64_t));
+}
+// Stream Part 3 out to an (unlinked) temporary file in $TMPDIR, in
+// sorted-array form, then map it back in read-only. Only the page index
+// and a small write buffer are held in memory; the kernel keeps the
+// mapped pages that look-ups hit, and reclaims the rest:
+void NgramCompressedCntMap::loadPagedOut(std::ifstream &file, size_t numRecords) {
+  entriesPerPage = sysconf(_SC_PAGESIZE) / sizeof(uint64_t);
+  pageIndex.reserve(numRecords/entriesPerPage + 1);
+  const char *tmpDir = getenv("TMPDIR");
+  if (tmpDir == NULL) tmpDir = "/tmp";
+  std::string pathStr = std::string(tmpDir) + "/nadaNgrams.XXXXXX";
+  std::vector<char> path(pathStr.begin(), pathStr.end()); path.push_back('\0');
+  int fd = mkstemp(&path[0]);
+  if (fd < 0) {
+	std::cerr << "Error! Can not create a temporary file in " << tmpDir << std::endl;
+	exit(-1);
+  }
+  unlink(&path[0]); // The mapping keeps it alive until we're done
+  if (inMemoryFileSystem(fd)) {
+	std::cerr << "Error! " << tmpDir << " is in memory (tmpfs), so paging the n-grams out there "
+			  << "would not save any; set TMPDIR to a directory on disk" << std::endl;
+	exit(-1);
+  }
+  std::vector<uint64_t> buffer;
+  buffer.reserve(PAGEOUTBUFFER);
+  size_t written = 0;
+  uint16_t token1=0, token2=0, token3=0, values=0;
+  bool ok = true;
+  while (ok && readNgramRecord(file, token1, token2, token3, values)) {
+	uint64_t entry = (packTokens(token1, token2, token3) << 16) | values;
+	if (!buffer.empty() && (entry >> 16) == (buffer.back() >> 16)) {
+	  buffer.back() = entry; // A repeat: the last record wins
+	  continue;
+	}
+	if (!buffer.empty() && (entry >> 16) < (buffer.back() >> 16)) {
+	  std::cerr << "Error! The n-grams are out of order, so they can't be paged out "
+				<< "without sorting them in memory; raise the memory budget" << std::endl;
+	  exit(-1);
+	}
+	if (buffer.size() == buffer.capacity()) {
+	  // Write out all but the newest entry, which a repeat may yet replace:
+	  ok = writeNgrams(fd, &buffer[0], buffer.size()-1, written, entriesPerPage, pageIndex);
+	  buffer[0] = buffer.back();
+	  buffer.resize(1);
+	}
+	buffer.push_back(entry);
+  }
+  if (ok && !buffer.empty())
+	ok = writeNgrams(fd, &buffer[0], buffer.size(), written, entriesPerPage, pageIndex);
+  if (!ok) {
+	std::cerr << "Error! Can not write the n-grams to a temporary file in " << tmpDir << std::endl;
+	exit(-1);
+  }
+  // Flush it to disk, so its page cache can be dropped too:
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  compacted = true;
+  numNgrams = written;
+  if (numNgrams > 0) {
+	pagedBytes = numNgrams*sizeof(uint64_t);
+	void *mapped = mmap(NULL, pagedBytes, PROT_READ, MAP_SHARED, fd, 0);
+	if (mapped == MAP_FAILED) {
+	  std::cerr << "Error! Can not map the paged-out n-grams" << std::endl;
+	  exit(-1);
+	}
+	madvise(mapped, pagedBytes, MADV_RANDOM); // Look-ups are scattered: don't read ahead
+	paged = mapped;
+	ngrams = (const uint64_t *)mapped;
+  }
+  close(fd);
+}
 /////////////////////////////////////////////////////////////////////////////////
-void NgramCompressedCntMap::find(const std::string lookup, int &itCount, int &theyCount) const {
+void NgramCompressedCntMap::find(const std::string lookup, uint32_t &itCount, uint32_t &theyCount) const {
   // Split the string into 4 parts
   int fillPosition = 3; // Default if we don't find it earlier
   std::vector<uint16_t> toks;
@@ -413,9 +843,8 @@ void NgramCompressedCntMap::find(const std::string lookup, int &itCount, int &th
   else if (fillPosition==1) toks[1] += 32768;
   else if (fillPosition==2) toks[2] += 32768;
   uint64_t token123 = (uint64_t)(toks[2]) + ((uint64_t)(toks[1]) << 16) + ((uint64_t)(toks[0]) << 32); // Pack them into one value 
-  TokenValueMap::const_iterator finder = tokenValMap.find(token123);
-  if (finder != tokenValMap.end()) {
-	uint16_t valueRank = finder->second; // The map just gives us the rank
+  uint16_t valueRank;
+  if (findValueRank(token123, valueRank)) {
 	CountPair cpair = rank2values[valueRank];  // It & They counts are stored in an <int,int> pair
 	itCount = cpair.first;
 	theyCount = cpair.second;
@@ -450,57 +879,238 @@ void NgramCompressedCntMap::initialize(char *filename) {
 	uint32_t theyCnt;  file.read((char *)&theyCnt, 4); // The they count
 	uint16_t rank;     file.read((char *)&rank, 2);    // Rank of that value
 	rank2values[rank] = CountPair(itCnt, theyCnt); // Create the count pair and add it on
+	if (itCnt > maxCnt) maxCnt = itCnt;
+	if (theyCnt > maxCnt) maxCnt = theyCnt;
 	// std::cout << "|" << itCnt << " " << theyCnt << ":" << rank << std::endl;
   }
-  ////// Part 3: Read the N-grams themselves:
-  uint16_t token1=0, token2, token3; // For reading them off
-  while (file.good()) {
-	uint16_t dummy;
-	uint16_t values;
-	file.read((char *)&dummy, 2);
-	if (dummy == NEWFIRSTFLAG) { // You should re-read everything: tokens 1, 2, and 3
-	  file.read((char *)&token1, 2);	
-	  file.read((char *)&token2, 2);	
-	  file.read((char *)&token3, 2);	
-	} else if (dummy == NEWSECONDFLAG) { // You should read from token-2 onwards
-	  file.read((char *)&token2, 2);	
-	  file.read((char *)&token3, 2);	
-	} else { // You just read the token-3 (most frequent case)
-	  token3 = dummy;
-	}
-	file.read((char *)&values, 2); // The value is always read last
-	uint64_t token123 = (uint64_t)(token3) + ((uint64_t)(token2) << 16) + ((uint64_t)(token1) << 32); // Pack them into one value 
-	tokenValMap[token123] = values; // Store the tokens->value mapping
+  ////// Part 3: Read the N-grams themselves. First count them, so we
+  ////// can choose how to store them within the memory budget:
+  std::streampos ngramStart = file.tellg();
+  size_t numRecords = 0;
+  uint16_t token1=0, token2=0, token3=0, values=0;
+  while (readNgramRecord(file, token1, token2, token3, values))
+	numRecords++;
+  file.clear();
+  file.seekg(ngramStart);
+  size_t otherBytes = memoryUsage(false);
+  size_t hashedBytes = hashMapBytesFor<TokenValueMap>(numRecords);
+  size_t sortedBytes = sizeof(sortedNgrams) + mallocBytes(numRecords*sizeof(uint64_t));
+  // Paged out, we hold the page index, and the write buffer while loading:
+  size_t pageEntries = sysconf(_SC_PAGESIZE) / sizeof(uint64_t);
+  size_t pagedOutBytes = sizeof(pageIndex) + mallocBytes((numRecords/pageEntries + 1)*sizeof(uint64_t))
+	+ mallocBytes(PAGEOUTBUFFER*sizeof(uint64_t));
+  if (memoryBudget == 0 || otherBytes + hashedBytes <= memoryBudget) {
+	loadHashed(file, numRecords);
+  } else if (otherBytes + sortedBytes <= memoryBudget) {
+	std::cerr << "(sorted, to fit the memory budget) ";
+	loadSorted(file, numRecords);
+  } else if (otherBytes + pagedOutBytes <= memoryBudget) {
+	std::cerr << "(paged out, to fit the memory budget) ";
+	loadPagedOut(file, numRecords);
+  } else {
+	std::cerr << "Error! The n-gram counts need " << otherBytes + pagedOutBytes
+			  << " bytes even when paged out, which does not fit in the memory budget" << std::endl;
+	exit(-1);
   }
-  std::cerr << "Read and stored " << tokenValMap.size()  << " N-grams." << std::endl;
+  std::cerr << "Read and stored " << (compacted ? numNgrams : tokenValMap.size()) << " N-grams." << std::endl;
   file.close();  // close the file
 }
 /////////////////////////////////////////////////////////////////////////////////
-// Load the n-gram counts from file:
+// Loading the text n-gram counts is split over threads, each with
+// a chunk of whole lines of the mapped file:
+const size_t MINCHUNKBYTES = 1 << 20;
+const int MAXLOADTHREADS = 16;
+struct NgramChunk {
+  const char *begin;              // The lines to parse
+  const char *end;
+  size_t numKeys;                 // How many ngram<TAB>counts lines it has
+  size_t keyBytes;                // Total length of their keys
+  std::vector<StrRef> keys;       // Point into the file, then into the arena
+  std::vector<CountPair> counts;
+  char *arenaPos;                 // Where in the arena they get copied to
+  const char *tooBig;             // A line with a count over UINT32_MAX, if any
+};
+// Read a count up to the stop character (like atoi, empty means 0);
+// sets tooBig if it doesn't fit in a uint32_t:
+inline uint32_t parseCount(const char *&pos, const char *end, char stop, bool &tooBig) {
+  uint64_t count = 0;
+  for (; pos < end && isdigit(*pos); pos++) {
+	count = count*10 + (*pos - '0');
+	if (count > UINT32_MAX) {
+	  tooBig = true;
+	  count = 0;
+	}
+  }
+  while (pos < end && *pos != stop && *pos != '\n') pos++;
+  if (pos < end && *pos == stop) pos++;
+  return (uint32_t)count;
+}
+// Thread phase 1: count the lines of this chunk, and the bytes of
+// their keys, without allocating anything:
+void *countNgramChunk(void *arg) {
+  NgramChunk *chunk = (NgramChunk *)arg;
+  chunk->numKeys = 0;
+  chunk->keyBytes = 0;
+  const char *pos = chunk->begin;
+  while (pos < chunk->end) {
+	const char *lineEnd = (const char *)memchr(pos, '\n', chunk->end-pos);
+	if (lineEnd == NULL) lineEnd = chunk->end;
+	const char *tab = (const char *)memchr(pos, '\t', lineEnd-pos);
+	if (tab != NULL) {
+	  chunk->numKeys++;
+	  chunk->keyBytes += tab-pos;
+	}
+	pos = lineEnd+1;
+  }
+  return NULL;
+}
+// Thread phase 2: parse the lines of this chunk:
+void *parseNgramChunk(void *arg) {
+  NgramChunk *chunk = (NgramChunk *)arg;
+  chunk->tooBig = NULL;
+  chunk->keys.reserve(chunk->numKeys);
+  chunk->counts.reserve(chunk->numKeys);
+  const char *pos = chunk->begin;
+  while (pos < chunk->end) {
+	const char *lineEnd = (const char *)memchr(pos, '\n', chunk->end-pos);
+	if (lineEnd == NULL) lineEnd = chunk->end;
+	const char *tab = (const char *)memchr(pos, '\t', lineEnd-pos);
+	if (tab != NULL) { // Skip anything that isn't ngram<TAB>counts
+	  chunk->keys.push_back(StrRef(pos, tab-pos));
+	  const char *line = pos;
+	  pos = tab+1;
+	  bool tooBig = false;
+	  uint32_t itCount = parseCount(pos, lineEnd, '\t', tooBig);
+	  uint32_t theyCount = parseCount(pos, lineEnd, '\t', tooBig);
+	  if (tooBig && chunk->tooBig == NULL)
+		chunk->tooBig = line;
+	  chunk->counts.push_back(CountPair(itCount, theyCount));
+	}
+	pos = lineEnd+1;
+  }
+  return NULL;
+}
+// Thread phase 3: intern this chunk's keys into its part of the arena:
+void *internNgramChunk(void *arg) {
+  NgramChunk *chunk = (NgramChunk *)arg;
+  char *pos = chunk->arenaPos;
+  for (size_t i=0; i<chunk->keys.size(); i++) {
+	memcpy(pos, chunk->keys[i].str, chunk->keys[i].len);
+	chunk->keys[i].str = pos;
+	pos += chunk->keys[i].len;
+  }
+  return NULL;
+}
+// Run the function over every chunk, one thread each:
+void runOverChunks(void *(*func)(void *), std::vector<NgramChunk> &chunks) {
+  std::vector<pthread_t> threads(chunks.size());
+  for (size_t i=1; i<chunks.size(); i++) {
+	if (pthread_create(&threads[i], NULL, func, &chunks[i]) != 0) {
+	  std::cerr << "Error! Can not start a loading thread" << std::endl;
+	  exit(-1);
+	}
+  }
+  func(&chunks[0]); // This thread takes the first chunk
+  for (size_t i=1; i<chunks.size(); i++)
+	pthread_join(threads[i], NULL);
+}
+// Load the n-gram counts from file: map it in, count and then parse
+// chunks of it in parallel, copy all the keys into one arena, then
+// build the table:
 void NgramCntMap::initialize(char *filename) {
-  std::cerr << "Loading n-gram counts ";
-  std::ifstream file(filename);
-  if (!file) {
+  std::cerr << "Loading n-gram counts. ";
+  int fd = open(filename, O_RDONLY);
+  struct stat fileStat;
+  if (fd < 0 || fstat(fd, &fileStat) != 0) {
     std::cerr << "Error! N-gram count file " << filename << " can not be opened" << std::endl;
     exit(-1);
   }
-  // parse each input line:
-  const int MAXCNTLENGTH = 12; // I see 8 at most, but it doesn't really matter as 
-                               // this is just for input's sake.
-  const int MAXNGRAMLENGTH = CNTNGRAMSIZE*(1+TRUNCATION);
-  // -- CNTGRAMSIZE N-grams of length TRUNCATION with a space after each (minus one, plus \0 at end)
-  char ngram[MAXNGRAMLENGTH];
-  while (file.getline(ngram, MAXNGRAMLENGTH, '\t')) {
-    char itCount[MAXCNTLENGTH];
-    file.getline(itCount, MAXCNTLENGTH, '\t');
-    char theyCount[MAXCNTLENGTH];
-    file.getline(theyCount, MAXCNTLENGTH, '\n');
-    // atoi returns 0 if empty, so this works for all:
-    CountPair itTheyCnt(atoi(itCount), atoi(theyCount));
-    // Load the count-map with the counts for this n-gram:
-	ngram2Cnts[ngram] = itTheyCnt;
-  }
-  // close the file
-  file.close();
-  std::cerr << "> done" << std::endl;
+  size_t fileBytes = fileStat.st_size;
+  const char *data = NULL;
+  if (fileBytes > 0) {
+	void *mapped = mmap(NULL, fileBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mapped == MAP_FAILED) {
+	  std::cerr << "Error! N-gram count file " << filename << " can not be mapped" << std::endl;
+	  exit(-1);
+	}
+	madvise(mapped, fileBytes, MADV_SEQUENTIAL);
+	data = (const char *)mapped;
+  }
+  close(fd); // The mapping stays valid
+  // Split into chunks on line boundaries:
+  long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t numChunks = fileBytes/MINCHUNKBYTES + 1;
+  if (numChunks > (size_t)numCpus) numChunks = (numCpus > 0) ? numCpus : 1;
+  if (numChunks > (size_t)MAXLOADTHREADS) numChunks = MAXLOADTHREADS;
+  std::vector<NgramChunk> chunks(numChunks);
+  const char *fileEnd = data + fileBytes;
+  for (size_t i=0; i<numChunks; i++) {
+	chunks[i].begin = (i == 0) ? data : chunks[i-1].end;
+	const char *end = data + fileBytes/numChunks*(i+1);
+	if (i+1 == numChunks || end <= chunks[i].begin) {
+	  end = (i+1 == numChunks) ? fileEnd : chunks[i].begin;
+	} else {
+	  const char *newline = (const char *)memchr(end, '\n', fileEnd-end);
+	  end = (newline != NULL) ? newline+1 : fileEnd;
+	}
+	chunks[i].end = end;
+  }
+  // Count first, so we can check the budget before allocating any of it:
+  runOverChunks(countNgramChunk, chunks);
+  size_t arenaBytes = 0, numNgrams = 0, chunkBytes = mallocBytes(numChunks*sizeof(NgramChunk));
+  for (size_t i=0; i<numChunks; i++) {
+	arenaBytes += chunks[i].keyBytes;
+	numNgrams += chunks[i].numKeys;
+	if (chunks[i].numKeys > 0)
+	  chunkBytes += mallocBytes(chunks[i].numKeys*sizeof(StrRef)) + mallocBytes(chunks[i].numKeys*sizeof(CountPair));
+  }
+  // There's no more compact form to fall back on here, so just make
+  // sure the peak will fit: the parsed chunks and the arena, plus the
+  // mapped file while we intern, then the table once it's unmapped:
+  size_t tableBytes = hashMapBytesFor<StrRef2Cnts>(numNgrams);
+  size_t neededBytes = chunkBytes + sizeof(arena) + mallocBytes(arenaBytes) + std::max(fileBytes, tableBytes);
+  if (memoryBudget > 0 && neededBytes > memoryBudget) {
+	std::cerr << "Error! Loading the n-gram counts needs " << neededBytes << " bytes at its peak, more than the memory budget of "
+			  << memoryBudget << std::endl;
+	exit(-1);
+  }
+  runOverChunks(parseNgramChunk, chunks);
+  for (size_t i=0; i<numChunks; i++) {
+	if (chunks[i].tooBig != NULL) {
+	  const char *lineEnd = (const char *)memchr(chunks[i].tooBig, '\n', fileEnd-chunks[i].tooBig);
+	  std::cerr << "Error! N-gram count over " << UINT32_MAX << " in " << filename << ": "
+				<< std::string(chunks[i].tooBig, lineEnd != NULL ? lineEnd : fileEnd) << std::endl;
+	  exit(-1);
+	}
+  }
+  // Give each chunk its place in the arena, and intern the keys:
+  arena.resize(arenaBytes);
+  char *arenaPos = arena.empty() ? NULL : &arena[0];
+  for (size_t i=0; i<numChunks; i++) {
+	chunks[i].arenaPos = arenaPos;
+	arenaPos += chunks[i].keyBytes;
+  }
+  runOverChunks(internNgramChunk, chunks);
+  if (data != NULL)
+	munmap((void *)data, fileBytes);
+  // Finally, fill the table (in file order, so later lines win as before):
+  ngram2Cnts.rehash((size_t)(numNgrams / ngram2Cnts.max_load_factor()) + 1);
+  for (size_t i=0; i<numChunks; i++) {
+	for (size_t j=0; j<chunks[i].keys.size(); j++) {
+	  CountPair itTheyCnt = chunks[i].counts[j];
+	  ngram2Cnts[chunks[i].keys[j]] = itTheyCnt;
+	  if (itTheyCnt.first > maxCnt) maxCnt = itTheyCnt.first;
+	  if (itTheyCnt.second > maxCnt) maxCnt = itTheyCnt.second;
+	}
+  }
+  std::cerr << "Read and stored " << ngram2Cnts.size() << " N-grams (" << numChunks << " threads)." << std::endl;
+}
+// Count (and maybe print) the bytes held by each of our structures;
+// returns the total resident:
+size_t NgramCntMap::memoryUsage(bool report) const {
+  size_t mapBytes = hashMapBytes(ngram2Cnts);
+  reportBytes(report, "ngram2Cnts", ngram2Cnts.size(), mapBytes);
+  size_t arenaBytes = vectorBytes(arena);
+  reportBytes(report, "ngram arena", ngram2Cnts.size(), arenaBytes);
+  return mapBytes + arenaBytes;
 }
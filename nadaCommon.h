@@ -9,12 +9,15 @@
 #include <stdio.h>   // For sprintf
 #include <stdlib.h>  // For all the exit()'s called by the mains
 #include <stdint.h>  // Where uint32_t and its friends live on some platforms
+#include <string.h>  // For memcmp
 #include <tr1/unordered_map>   // For storing the weights, n-grams, etc.
 #include <vector>
 #include <string>
 //// To compile this without tr1, try switching
 //// "std::tr1::unordered_map" to just "map" in all code
 typedef std::tr1::unordered_map<std::string,int> StrIntMap;
+// Sums of n-gram counts (too big for an int in large tables):
+typedef std::tr1::unordered_map<std::string,uint64_t> StrCountMap;
 // Mapping a string to float is our most common pair:
 typedef std::pair<std::string,float> StrFloatPair;
 // Holds the real-valued features and their values:
@@ -31,22 +34,65 @@ typedef std::pair<uint32_t,uint32_t> CountPair;
 // compressed implementations of the N-gram data
 class NgramMapBase {
  public:
-  virtual void find(const std::string lookup, int &itCount, int &theyCount) const = 0;
+  virtual void find(const std::string lookup, uint32_t &itCount, uint32_t &theyCount) const = 0;
   // Load the n-gram counts from file:
   virtual void initialize(char *filename) = 0;
+  // The largest it- or they-count in the table (bounds the count features):
+  virtual uint32_t maxCount() const = 0;
+  // Print the bytes held by each of our structures; returns the total resident:
+  virtual size_t reportMemory() const = 0;
+  // Keep our structures within this many bytes (0: no limit), choosing
+  // how to store them as we load. Call before initialize, which quits
+  // before building anything that can't fit:
+  void setMemoryBudget(size_t budget) { memoryBudget = budget; }
  protected:
+  NgramMapBase() : memoryBudget(0) {}
   virtual ~NgramMapBase() {};
+  size_t memoryBudget;
+};
+/////////////////////////////////////////////////////////////////////////////////
+// A string we don't own: a key in the n-gram arena, or a look-up string
+struct StrRef {
+  const char *str;
+  uint32_t len;
+  StrRef(const char *s, uint32_t l) : str(s), len(l) {}
+};
+struct StrRefHash {
+  size_t operator()(const StrRef &ref) const {
+	uint64_t hash = 14695981039346656037ULL; // 64-bit FNV-1a
+	for (uint32_t i=0; i<ref.len; i++) {
+	  hash ^= (unsigned char)ref.str[i];
+	  hash *= 1099511628211ULL;
+	}
+	return (size_t)hash;
+  }
+};
+struct StrRefEqual {
+  bool operator()(const StrRef &a, const StrRef &b) const {
+	return a.len == b.len && memcmp(a.str, b.str, a.len) == 0;
+  }
 };
 /////////////////////////////////////////////////////////////////////////////////
 // Stores and returns the N-gram counts: each one has a it-count and a they-count:
 class NgramCntMap : public NgramMapBase {
+  typedef std::tr1::unordered_map<StrRef,CountPair,StrRefHash,StrRefEqual> StrRef2Cnts;
  private:
+  // All the n-gram strings, back to back, interned once; the keys of
+  // ngram2Cnts point in here:
+  std::vector<char> arena;
   // A structure to hold the counts
-  std::tr1::unordered_map<std::string,CountPair> ngram2Cnts;
+  StrRef2Cnts ngram2Cnts;
+  uint32_t maxCnt;
+  // Count (and maybe print) the bytes held by each of our structures:
+  size_t memoryUsage(bool report) const;
+  // Our keys point into our own arena, so we can't be copied:
+  NgramCntMap(const NgramCntMap &);
+  NgramCntMap &operator=(const NgramCntMap &);
  public:
+  NgramCntMap() : maxCnt(0) {}
   // Returns '0' if not found, otherwise returns value1 and value2 as the values:
-  void find(const std::string lookup, int &itCount, int &theyCount) const {
-	std::tr1::unordered_map<std::string,CountPair>::const_iterator finder = ngram2Cnts.find(lookup);
+  void find(const std::string lookup, uint32_t &itCount, uint32_t &theyCount) const {
+	StrRef2Cnts::const_iterator finder = ngram2Cnts.find(StrRef(lookup.data(), lookup.size()));
 	if (finder != ngram2Cnts.end()) {
 	  CountPair cpair = finder->second; // It & They counts are stored in an <int,int> pair
 	  itCount = cpair.first;
@@ -56,8 +102,10 @@ class NgramCntMap : public NgramMapBase {
 	  theyCount = 0;
 	}
   }
-  // Load the n-gram counts from file:
+  // Load the n-gram counts from file (ngram<TAB>itCount<TAB>theyCount lines):
   void initialize(char *filename);
+  uint32_t maxCount() const { return maxCnt; }
+  size_t reportMemory() const { return memoryUsage(true); }
 };
 /////////////////////////////////////////////////////////////////////////////////
 // Stores and returns the N-gram counts: each one has a it-count and a they-count:
@@ -72,12 +120,103 @@ class NgramCompressedCntMap : public NgramMapBase {
   String2Uint16 token2rank;  
   // A structure to map uint16 value-rank integers to it/they counts:
   std::vector<CountPair> rank2values;
+  uint32_t maxCnt;
+  // The compact alternative to tokenValMap, chosen at load time if the
+  // memory budget needs it: one sorted array of (token123 << 16 | value
+  // rank). ngrams points either into sortedNgrams, or (when paged out)
+  // into a read-only mapping of a temporary file:
+  bool compacted;
+  std::vector<uint64_t> sortedNgrams;
+  const uint64_t *ngrams;
+  size_t numNgrams;
+  void *paged;
+  size_t pagedBytes;
+  // When paged out, the first entry of each page of the mapping stays
+  // resident, so a look-up only touches the one page its N-gram is on:
+  std::vector<uint64_t> pageIndex;
+  size_t entriesPerPage;
+  // Get the value rank for the packed tokens, from whichever representation:
+  bool findValueRank(uint64_t token123, uint16_t &valueRank) const;
+  // The ways of loading Part 3 of the file, numRecords N-grams:
+  void loadHashed(std::ifstream &file, size_t numRecords);
+  void loadSorted(std::ifstream &file, size_t numRecords);
+  void loadPagedOut(std::ifstream &file, size_t numRecords);
+  // Count (and maybe print) the bytes held by each of our structures:
+  size_t memoryUsage(bool report) const;
+  // ngrams points into our own vector or mapping, so we can't be copied:
+  NgramCompressedCntMap(const NgramCompressedCntMap &);
+  NgramCompressedCntMap &operator=(const NgramCompressedCntMap &);
  public:
-  void find(const std::string lookup, int &itCount, int &theyCount) const;
+  NgramCompressedCntMap() : maxCnt(0), compacted(false), ngrams(NULL), numNgrams(0), paged(NULL), pagedBytes(0),
+							entriesPerPage(0) {}
+  ~NgramCompressedCntMap();
+  void find(const std::string lookup, uint32_t &itCount, uint32_t &theyCount) const;
   // Load the n-gram counts from file:
   void initialize(char *filename);
+  uint32_t maxCount() const { return maxCnt; }
+  size_t reportMemory() const { return memoryUsage(true); }
+};
+/////////////////////////////////////////////////////////////////////////////////
+// For the thresholded decision mode: the weights of each count-feature
+// template, indexed by offset, so we can bound what the n-gram look-ups
+// still left to do could add to the score:
+struct DecisionBounds {
+  std::vector<float> ngmUndef;  // $size,$offset+NGM=UNDEF
+  std::vector<float> it;        // $size,$offset+IT
+  std::vector<float> itUndef;   // $size,$offset+IT-UNDEF
+  std::vector<float> they;      // $size,$offset+THEY
+  std::vector<float> theyUndef; // $size,$offset+THEY-UNDEF
+  float totalIt;                // $size+IT
+  float totalThey;              // $size+THEY
+  uint32_t maxCount;            // Largest count any look-up can return
+};
+// How much work the early exit saved us:
+struct DecisionStats {
+  size_t lookups;  // N-gram look-ups done
+  size_t skipped;  // N-gram look-ups we didn't need
+  DecisionStats() : lookups(0), skipped(0) {}
 };
 /////////////////////////////////////////////////////////////////////////////////
+// Bytes malloc really takes for a request: glibc adds a size word and
+// rounds up to 16-byte chunks, 32 bytes at least. (Big requests are
+// mmap'd, and rounded up to pages instead, which is close enough.)
+inline size_t mallocBytes(size_t request) {
+#ifdef __GLIBC__
+  size_t chunk = (request + sizeof(size_t) + 15) & ~(size_t)15;
+  return (chunk < 4*sizeof(size_t)) ? 4*sizeof(size_t) : chunk;
+#else
+  return request;
+#endif
+}
+// Bytes held by a tr1::unordered_map, hash-table overhead included: one
+// node (the value plus a next pointer) per element, and bucket_count()+1
+// bucket pointers. Keys' own heap storage is counted by stringHeapBytes:
+template <class Map>
+size_t hashMapBytes(size_t entries, size_t buckets) {
+  struct Node { typename Map::value_type value; void *next; };
+  return sizeof(Map) + entries*mallocBytes(sizeof(Node)) + mallocBytes((buckets+1)*sizeof(void *));
+}
+template <class Map>
+size_t hashMapBytes(const Map &m) {
+  return hashMapBytes<Map>(m.size(), m.bucket_count());
+}
+// What a tr1::unordered_map rehash()'d for this many entries will hold
+// (it rounds the buckets up to a prime, less than 1/8 more):
+template <class Map>
+size_t hashMapBytesFor(size_t entries) {
+  return hashMapBytes<Map>(entries, entries + entries/8 + 1);
+}
+// Bytes held by a vector:
+template <class T>
+size_t vectorBytes(const std::vector<T> &v) {
+  return sizeof(v) + (v.capacity() ? mallocBytes(v.capacity()*sizeof(T)) : 0);
+}
+// Bytes a string holds on the heap (none if it fits in the string itself):
+inline size_t stringHeapBytes(const std::string &s) {
+  static const size_t localCapacity = std::string().capacity();
+  return (s.capacity() > localCapacity) ? mallocBytes(s.capacity()+1) : 0;
+}
+/////////////////////////////////////////////////////////////////////////////////
 // Preprocess the input words to convert digits to 0
 inline void normWords(std::string &input) {
   for (std::string::iterator cItr=input.begin(); cItr != input.end(); cItr++)
@@ -106,7 +245,17 @@ void buildLexicalFeatureVector(size_t pos, const StrVec &words, StrVec &bfeats);
 void buildCntFeatureVector(size_t pos, const StrVec &patts, const NgramMapBase &cnts, RealFeats &rfeats);
 // Get the prediction probability for this example
 float getPredictions(const FeatureWeightMap &weights, const StrVec &binFeats, const RealFeats &realFeats);
+// Precompute the per-template score bounds from the weights and n-gram data:
+void initializeDecisionBounds(const FeatureWeightMap &weights, const NgramMapBase &cnts, DecisionBounds &bounds);
+// Get the thresholded 0/1 decision for this example, doing n-gram
+// look-ups only until the decision can no longer change. Always
+// agrees with (getPredictions(...) >= threshold):
+bool getDecision(const FeatureWeightMap &weights, const DecisionBounds &bounds, float threshold,
+				 size_t pos, const StrVec &binFeats, const StrVec &patts, const NgramMapBase &cnts,
+				 DecisionStats &stats);
 // Load the weight vector from file:
 void initializeFeatureWeights(char *filename, FeatureWeightMap &weights);
+// Count (and maybe print) the bytes held by the weights:
+size_t weightMemory(const FeatureWeightMap &weights, bool report);
 
 #endif // NADACOMMON_H
@@ -6,14 +6,21 @@
 #include <iostream>   // For reading/writing STDIN
 #include <sstream>    // For parsing the input
 #include <time.h>     // For timing:
+#include <errno.h>    // For checking the --memory-budget number
 #include "nadaCommon.h"
 
-const std::string USAGE = "USAGE: cat tokenizedFile | ./nadaIt featureWeights ngramCnts";
+const std::string USAGE = "USAGE: cat tokenizedFile | ./nadaIt [--threshold p] [--memory-budget bytes] [--ngram-backend compressed|text] featureWeights ngramCnts\n"
+  "  --threshold p          : output 0/1 decisions (probability >= p) instead of probabilities\n"
+  "  --memory-budget bytes  : shrink the model to fit in this many bytes (e.g. 512M, 2G), or quit\n"
+  "  --ngram-backend format : ngramCnts is our compressed binary format (default), or\n"
+  "                           plain text lines of: ngram<TAB>itCount<TAB>theyCount";
 //#define DEBUG 1
 
 // Generate feature vectors from words and patterns, make predictions
-// on the basis of the feature weights and n-gram counts:
-void processSentence(const StrVec &words, const FeatureWeightMap &weights, const NgramMapBase &cnts, const Indices &itPositions) {
+// on the basis of the feature weights and n-gram counts. If a decision
+// threshold is given (bounds != NULL), output 0/1 decisions instead:
+void processSentence(const StrVec &words, const FeatureWeightMap &weights, const NgramMapBase &cnts, const Indices &itPositions,
+					 const DecisionBounds *bounds, float threshold, DecisionStats &stats) {
   // First, generate the patternized words you'll need for the N-gram look-ups, 
   // and also normalize the strings for the lexicalized feature making:
   StrVec patts; StrVec lexemes;
@@ -38,6 +45,11 @@ void processSentence(const StrVec &words, const FeatureWeightMap &weights, const
     //////////////////////////
     StrVec lexFeats; // First, get lexical features:
     buildLexicalFeatureVector(position, lexemes, lexFeats);
+	if (bounds != NULL) { // Only look up the n-grams the decision needs
+	  bool decision = getDecision(weights, *bounds, threshold, position, lexFeats, patts, cnts, stats);
+	  std::cout << '\t' << position << ':' << decision;
+	  continue;
+	}
     RealFeats cntFeats; // Then the real-valued (count) ones
     buildCntFeatureVector(position, patts, cnts, cntFeats);
     // Now multiply these features by the weights
@@ -46,21 +58,94 @@ void processSentence(const StrVec &words, const FeatureWeightMap &weights, const
     std::cout << '\t' << position << ':' << std::fixed << prediction;
   }
 }
+// Parse a byte count with an optional K/M/G suffix; returns 0 if invalid
+// (only digits, then the suffix; nothing that overflows):
+size_t parseBytes(const char *str) {
+  if (!isdigit(*str)) return 0; // strtoull would take spaces and '-'
+  char *suffix;
+  errno = 0;
+  unsigned long long bytes = strtoull(str, &suffix, 10);
+  if (errno == ERANGE) return 0;
+  unsigned long long multiplier = 1;
+  if (*suffix == 'K' || *suffix == 'k') { multiplier = 1024ULL; suffix++; }
+  else if (*suffix == 'M' || *suffix == 'm') { multiplier = 1024ULL*1024; suffix++; }
+  else if (*suffix == 'G' || *suffix == 'g') { multiplier = 1024ULL*1024*1024; suffix++; }
+  if (*suffix != '\0' || bytes == 0 || bytes > (size_t)-1 / multiplier) return 0;
+  return (size_t)(bytes * multiplier);
+}
 ////////////////////////////////////////////////
 // Run program
 ////////////////////////////////////////////////
 int main(int nargin, char** argv) {
-  if (nargin != 3) {
+  // Pull out the options, leaving the two file arguments:
+  float threshold = -1; // Negative means: output probabilities
+  size_t memoryBudget = 0; // Zero means: no budget
+  bool textNgrams = false;
+  std::vector<char *> files;
+  for (int i=1; i<nargin; i++) {
+	std::string arg = argv[i];
+	if (arg == "--threshold" && i+1<nargin) {
+	  threshold = atof(argv[++i]);
+	  if (threshold <= 0 || threshold >= 1) {
+		std::cerr << "Error! Threshold must be strictly between 0 and 1" << std::endl;
+		exit(-1);
+	  }
+	} else if (arg == "--memory-budget" && i+1<nargin) {
+	  memoryBudget = parseBytes(argv[++i]);
+	  if (memoryBudget == 0) {
+		std::cerr << "Error! Memory budget must be a positive whole number of bytes, optionally with a K/M/G suffix" << std::endl;
+		exit(-1);
+	  }
+	} else if (arg == "--ngram-backend" && i+1<nargin) {
+	  std::string backend = argv[++i];
+	  if (backend != "compressed" && backend != "text") {
+		std::cerr << "Error! Unknown n-gram backend " << backend << std::endl;
+		exit(-1);
+	  }
+	  textNgrams = (backend == "text");
+	} else if (arg.compare(0, 2, "--") == 0) {
+	  std::cerr << USAGE << std::endl;
+	  exit(-1);
+	} else {
+	  files.push_back(argv[i]);
+	}
+  }
+  if (files.size() != 2) {
     std::cerr << USAGE << std::endl;
 	exit(-1);
   }
   ////////////////////////////////////////////////
   // Initialization: First, load the weight vector:
   FeatureWeightMap weights;
-  initializeFeatureWeights(argv[1], weights);
-  // Then, load the n-gram counts:
-  NgramCompressedCntMap ngramCnts;
-  ngramCnts.initialize(argv[2]);
+  initializeFeatureWeights(files[0], weights);
+  // Then, load the n-gram counts with the chosen backend, within
+  // whatever the weights leave of the memory budget:
+  NgramCompressedCntMap compressedCnts;
+  NgramCntMap textCnts;
+  NgramMapBase &ngramCnts = textNgrams ? (NgramMapBase &)textCnts : (NgramMapBase &)compressedCnts;
+  if (memoryBudget > 0) {
+	size_t weightBytes = weightMemory(weights, false);
+	if (weightBytes >= memoryBudget) {
+	  std::cerr << "Error! The weights alone (" << weightBytes << " bytes) do not fit in the memory budget of "
+				<< memoryBudget << " bytes" << std::endl;
+	  exit(-1);
+	}
+	ngramCnts.setMemoryBudget(memoryBudget - weightBytes);
+  }
+  ngramCnts.initialize(files[1]);
+  // Report what the model costs us:
+  std::cerr << "Model memory:" << std::endl;
+  size_t modelBytes = weightMemory(weights, true) + ngramCnts.reportMemory();
+  std::cerr << "  total: " << modelBytes << " bytes" << std::endl;
+  if (memoryBudget > 0 && modelBytes > memoryBudget) {
+	std::cerr << "Error! The model does not fit in the memory budget of " << memoryBudget << " bytes" << std::endl;
+	exit(-1);
+  }
+  // For decisions, bound what each count template can add to the score:
+  DecisionBounds bounds;
+  DecisionStats stats;
+  if (threshold > 0)
+	initializeDecisionBounds(weights, ngramCnts, bounds);
   // Start timing of program
   clock_t startTime = clock();
   ////////////////////////////////////////////////
@@ -82,13 +167,15 @@ int main(int nargin, char** argv) {
     std::cout << originalString;
     // Make predictions if the word 'it' is in the sentence:
     if (!itPositions.empty())
-	  processSentence(words, weights, ngramCnts, itPositions);
+	  processSentence(words, weights, ngramCnts, itPositions, (threshold > 0) ? &bounds : NULL, threshold, stats);
     std::cout << std::endl;
   }
   // Report timing
   clock_t endTime = clock(); //record time that predicting ends
   float time_task = ((double)(endTime - startTime)) / CLOCKS_PER_SEC;    //compute elapsed time of task
   std::cerr << time_task << " seconds for predictions" << std::endl;
+  if (threshold > 0)
+	std::cerr << stats.skipped << " of " << (stats.lookups+stats.skipped) << " n-gram look-ups skipped by early exit" << std::endl;
   return 1;
 }
 